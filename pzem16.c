@@ -51,6 +51,16 @@ extern "C" {
 #include <ctype.h>
 #include <getopt.h>
 #include <syslog.h>
+#include <signal.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
 
 #if CHECKFORCLEARLOCKRACE
 #include <glob.h>
@@ -68,18 +78,37 @@ extern "C" {
 #define PFACTOR   0x0008
 #define FREQUENCY 0x0007
 #define TAENERGY  0x0005
+#define ALARM     0x0009
+
+// Measurement block, VOLTAGE..ALARM read in a single request
+#define BLOCK_START 0x0000
+#define BLOCK_SIZE  10
 
 // Write
 #define DEVICE_ID 0x0002
 
 #define MAX_RETRIES 100
 
+// Adaptive response timeout, RFC 6298 style: RTO = SRTT + max(K*RTTVAR, margin)
+#define RTO_K       4
+#define RTO_MARGIN  20000           /* us, covers USB serial adapter latency */
+#define RTO_MAX     5000000         /* us, cap of the per retry doubling */
+#define MAX_ADDRESSES 247
+#define MAX_BUSES     16
+
 #define RESTART_TRUE  1
 #define RESTART_FALSE 0
 
 #define DEBUG_STDERR 1
 #define DEBUG_SYSLOG 2
 
+#define OUT_DEFAULT 0
+#define OUT_IEC     1
+#define OUT_COMPACT 2
+
+#define DEFAULT_SOCKET   "/var/run/pzem16.sock"
+#define DEFAULT_INTERVAL 1000     /* ms between daemon polls */
+
 int debug_mask     = 0; //DEBUG_STDERR | DEBUG_SYSLOG; // Default, let pass all
 int debug_flag     = 0;
 int trace_flag     = 0;
@@ -89,6 +118,8 @@ int metern_flag    = 0;
 const char *version     = "1.0";
 char *programName;
 const char *ttyLCKloc   = "/var/lock/LCK.."; /* location and prefix of serial port lock file */
+const char *ttyARBloc   = "/dev/shm/pzem16.arb."; /* location and prefix of serial port arbiter */
+const char *ttyCACHEloc = "/dev/shm/pzem16.cache."; /* location and prefix of latest readings cache */
 
 #define CMDLINESIZE 128            /* should be enough for debug */
 char cmdline[CMDLINESIZE]="";    
@@ -98,22 +129,150 @@ long unsigned int PPID;
 char *PARENTCOMMAND = NULL;
 
 static int yLockWait = 0;          /* Seconds to wait to lock serial port */
+static int legacy_lock = 0;        /* Also honour the LCK.. lock file */
 static time_t command_delay = -1;  // = 30;  /* MilliSeconds to wait before sending a command */
 static time_t settle_time = -1;    // us to wait line to settle before starting chat
+static int num_retries = 1;
+#if LIBMODBUS_VERSION_MAJOR >= 3 && LIBMODBUS_VERSION_MINOR >= 1 && LIBMODBUS_VERSION_MICRO >= 2
+static uint32_t resp_timeout = 2;
+static uint32_t byte_timeout = -1;
+#else
+static time_t resp_timeout = 2;
+static time_t byte_timeout = -1;
+#endif
+
+/* Registers backing every value, in output order */
+enum { M_VOLTAGE, M_CURRENT, M_POWER, M_PFACTOR, M_FREQUENCY, M_TAENERGY, M_COUNT };
+
+typedef struct {
+    int address;        /* first register */
+    int nb;             /* 1 = 16 bit, 2 = 32 bit low word first */
+    float divisor;
+    const char *label;  /* default output */
+    const char *unit;
+    const char *id;     /* IEC 62056 output */
+    const char *iec_unit;
+    int integer;        /* printed without decimals */
+} measure_t;
+
+static const measure_t measures[M_COUNT] = {
+    [M_VOLTAGE]   = { VOLTAGE,   1,   10.0f, "Voltage",             "V",  "V",  "V",  0 },
+    [M_CURRENT]   = { CURRENT,   2, 1000.0f, "Current",             "A",  "C",  "A",  0 },
+    [M_POWER]     = { POWER,     2,   10.0f, "Power",               "W",  "P",  "W",  0 },
+    [M_PFACTOR]   = { PFACTOR,   1,    1.0f, "Power Factor",        "",   "PF", "F",  0 },
+    [M_FREQUENCY] = { FREQUENCY, 1,   10.0f, "Frequency",           "Hz", "F",  "Hz", 0 },
+    [M_TAENERGY]  = { TAENERGY,  2,    1.0f, "Total Active Energy", "Wh", "TE", "Wh", 1 },
+};
+
+/* Outcome of a request, per value of a reading */
+enum { ST_OK, ST_TIMEOUT, ST_CRC, ST_EXCEPTION, ST_ERROR, ST_UNREAD, ST_COUNT };
+
+static const char *status_names[ST_COUNT] = {
+    [ST_OK]        = "OK",
+    [ST_TIMEOUT]   = "timeout",
+    [ST_CRC]       = "crc",           /* bad CRC or framing */
+    [ST_EXCEPTION] = "exception",     /* the meter refused the request */
+    [ST_ERROR]     = "error",
+    [ST_UNREAD]    = "unread",        /* not requested */
+};
+
+#define BACKOFF_BASE   10000        /* us, first timeout backoff */
+#define BACKOFF_MAX    500000       /* us, backoff cap */
+
+#define MEASURE_BIT(m) (1u << (m))
+#define MEASURE_ALL    ((1u << M_COUNT) - 1)
+
+/* One decoded block read */
+typedef struct {
+    const char *bus;            /* tags the record when several buses are read */
+    int address;
+    int valid;                  /* at least one value was read */
+    long rto;                   /* us, response timeout to use, 0 = as set */
+    long rtt;                   /* us, round trip of the successful request */
+    uint16_t reg[BLOCK_SIZE];   /* raw measurement block */
+    float value[M_COUNT];
+    uint8_t status[M_COUNT];    /* ST_ of each value */
+    uint16_t alarm;
+    struct timespec taken;      /* CLOCK_MONOTONIC */
+} reading_t;
 
-char *devLCKfile = NULL;
-char *devLCKfileNew = NULL;
+/*
+ * Bus arbiter: a FIFO ticket lock shared by every pzem16 process using the
+ * port. The holder hands the bus over by bumping serving and waking the
+ * waiters on that futex word, the next ticket runs at once. Each ticket
+ * slot records the owner pid, so tickets of dead holders or waiters are
+ * skipped by whoever finds them.
+ */
+#define ARB_SLOTS      256
+#define ARB_CHECK_MS   250          /* holder liveness check while waiting */
+
+typedef struct {
+    _Atomic uint32_t next;          /* next ticket to hand out */
+    _Atomic uint32_t serving;       /* ticket owning the bus, futex word */
+    _Atomic uint64_t slot[ARB_SLOTS];   /* ticket << 32 | pid, pid 0 = given up */
+} arbiter_t;
+
+/*
+ * Latest readings cache: every successful block read is published, per
+ * bus and address, under a seqlock so readers never take the bus lock.
+ */
+typedef struct {
+    _Atomic uint32_t seq;       /* odd while being written */
+    uint32_t okmask;            /* MEASURE_BIT of the values good in reg, 0 = last attempt failed */
+    int64_t taken;              /* CLOCK_MONOTONIC ns of reg */
+    uint16_t reg[BLOCK_SIZE];
+    int32_t srtt;               /* us, smoothed RTT, 0 = no sample yet */
+    int32_t rttvar;             /* us, RTT variation; both only used under the bus lock */
+} cache_entry_t;
+
+typedef struct {
+    cache_entry_t entry[MAX_ADDRESSES+1];
+} cache_t;
+
+/* One serial bus, its lock and the meters polled on it */
+typedef struct {
+    const char *device;         /* i.e. /dev/ttyUSB0 */
+    arbiter_t *arb;
+    cache_t *cache;
+    uint32_t ticket;
+    int LCKheld;                /* LCK.. file lock taken too */
+    char *devLCKfile;
+    char *devLCKfileNew;
+    modbus_t *ctx;
+    int count;
+    reading_t *readings;
+    int failed;
+    char *output;               /* records rendered by the bus worker */
+    size_t output_size;
+    pthread_t thread;
+} bus_t;
+
+int lockBus(bus_t *bus);
+void unlockBus(bus_t *bus);
+
+static int output_format = OUT_DEFAULT;
+static unsigned measure_mask = MEASURE_ALL;
+static long interval_ms = DEFAULT_INTERVAL;
+static long max_age_ms = 0;        /* answer from the cache when fresher */
+static int adaptive_timeout = 0;   /* per meter response timeout from measured RTT */
+
+static volatile sig_atomic_t terminate = 0;
+static pthread_mutex_t readings_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t terminate_cond;
 
 void usage(char* program) {
     printf("pzem16 %s: ModBus RTU client to read EASTRON SDM120C smart mini power meter registers\n",version);
     printf("Copyright (C) 2012 Pierantonio Tabaro <toni.tabaro@gmail.com>\n");
     printf("based on: Copyright (C) 2015 Gianfranco Di Prinzio <gianfrdp@inwind.it>\n");
     printf("Complied with libmodbus %s\n\n", LIBMODBUS_VERSION_STRING);
-    printf("Usage: %s [-a address] [-d n] [-x] [-p] [-v] [-c] [-e] [-i] [-t] [-f] [-g] [[-m]|[-q]] [-z num_retries] [-j seconds] [-w seconds] [-1 | -2] device\n", program);
+    printf("Usage: %s [-a address] [-d n] [-x] [-p] [-v] [-c] [-e] [-i] [-t] [-f] [-g] [[-m]|[-q]] [-z num_retries] [-j seconds] [-w seconds] [-1 | -2] device [device...]\n", program);
+    printf("       %s [-a address] [-d n] [-x] [-z num_retries] [-j seconds] [-w seconds] --daemon [--socket path] [--interval ms] device [device...]\n", program);
+    printf("       %s [-p] [-v] [-c] [-t] [-f] [-g] [[-m]|[-q]] --socket path\n", program);
     printf("       %s [-a address] [-d n] [-x] [-z num_retries] [-j seconds] [-w seconds] -s new_address device\n", program);
     printf("Required:\n");
-    printf("\tdevice\t\tSerial device (i.e. /dev/ttyUSB0)\n");
-    printf("\t-a address \tMeter number (1-247). Default: 1\n");
+    printf("\tdevice\t\tSerial device (i.e. /dev/ttyUSB0). Several devices are\n");
+    printf("\t\t\tread in parallel, one thread per bus\n");
+    printf("\t-a address \tMeter number (1-247) or list of meters (i.e. 1,2,5-12). Default: 1\n");
     printf("Reading parameters (no parameter = retrieves all values):\n");
     printf("\t-p \t\tGet power (W)\n");
     printf("\t-v \t\tGet voltage (V)\n");
@@ -121,6 +280,8 @@ void usage(char* program) {
     printf("\t-f \t\tGet frequency (Hz)\n");
     printf("\t-g \t\tGet power factor\n");
     printf("\t-t \t\tGet total energy (Wh)\n");
+    printf("\t--max-age ms\tAnswer from the readings cache (%s<tty>) when\n", ttyCACHEloc);
+    printf("\t\t\tnot older than ms, read the bus otherwise\n");
     printf("\t-m \t\tOutput values in IEC 62056 format ID(VALUE*UNIT)\n");
     printf("\t-q \t\tOutput values in compact mode\n");
     printf("Writing new settings parameters:\n");
@@ -129,13 +290,25 @@ void usage(char* program) {
     printf("\t-z num_retries\tTry to read max num_retries times on bus before exiting\n");
     printf("\t\t\twith error. Default: 1 (no retry)\n");
     printf("\t-j 1/10 secs\tResponse timeout. Default: 2=0.2s\n");
+    printf("\t--adaptive-timeout\n");
+    printf("\t\t\tPer meter response timeout from its measured round trip\n");
+    printf("\t\t\t(smoothed RTT + %d x variation), doubled on each retry.\n", RTO_K);
+    printf("\t\t\t-j is used until the meter has answered once\n");
     printf("\t-D 1/1000 secs\tDelay before sending commands. Default: 0ms\n");
     printf("\t-w seconds\tTime to wait to lock serial port (1-30s). Default: 0s\n");
     printf("\t-W 1/1000 secs\tTime to wait for 485 line to settle. Default: 0ms\n");
+    printf("\t--lck-file\tAlso take the %s<tty> lock file, for tools\n", ttyLCKloc);
+    printf("\t\t\tthat don't know the %s<tty> bus arbiter\n", ttyARBloc);
     printf("\t-y 1/1000 secs\tSet timeout between every bytes (1-500). Default: disabled\n");
     printf("\t-d debug_level\tDebug (0=disable, 1=debug, 2=errors to syslog, 3=both)\n");
     printf("\t\t\tDefault: 0\n");
     printf("\t-x \t\tTrace (libmodbus debug on)\n");
+    printf("Daemon mode:\n");
+    printf("\t--daemon\tKeep the port open, poll the meter and serve the latest\n");
+    printf("\t\t\treadings on the socket (runs in foreground)\n");
+    printf("\t--socket path\tUnix socket to serve on, or to query when not in\n");
+    printf("\t\t\tdaemon mode. Default: %s\n", DEFAULT_SOCKET);
+    printf("\t--interval ms\tDaemon polling interval. Default: %dms\n", DEFAULT_INTERVAL);
 }
 
 /*--------------------------------------------------------------------------
@@ -148,6 +321,14 @@ static long inline tv_diff(struct timeval const * const t1, struct timeval const
     return res.tv_sec*1000000 + res.tv_usec;
 }
 
+/*--------------------------------------------------------------------------
+    ts_diff_ms
+----------------------------------------------------------------------------*/
+static long inline ts_diff_ms(struct timespec const * const t1, struct timespec const * const t2)
+{
+    return (t1->tv_sec - t2->tv_sec)*1000L + (t1->tv_nsec - t2->tv_nsec)/1000000L;
+}
+
 /*--------------------------------------------------------------------------
         rnd_usleep
 ----------------------------------------------------------------------------*/
@@ -166,14 +347,13 @@ static long inline rnd_usleep(const useconds_t usecs)
 char* getCurTime()
 {
     time_t curTimeValue;
-    struct tm *ltime;
-    static struct timeval _t;
-    static struct timezone tz;
-    static char CurTime[100];
+    struct tm tm, *ltime = &tm;
+    struct timeval _t;
+    static __thread char CurTime[100];
 
-    time(&curTimeValue);
-    ltime = (struct tm *) localtime(&curTimeValue);
-    gettimeofday(&_t, &tz);
+    gettimeofday(&_t, NULL);
+    curTimeValue = _t.tv_sec;
+    localtime_r(&curTimeValue, ltime);
 
     sprintf(CurTime, "%04d%02d%02d-%02d:%02d:%02d.%06d", ltime->tm_year + 1900, ltime->tm_mon + 1, ltime->tm_mday, ltime->tm_hour, ltime->tm_min, ltime->tm_sec, (int)_t.tv_usec);
 
@@ -254,7 +434,9 @@ void *getMemPtr(size_t mSize)
     ClrSerLock
     Clear Serial Port lock.
 ----------------------------------------------------------------------------*/
-int ClrSerLock(long unsigned int LckPID) {
+int ClrSerLock(const bus_t *bus, long unsigned int LckPID) {
+    const char *devLCKfile = bus->devLCKfile;
+    const char *devLCKfileNew = bus->devLCKfileNew;
     FILE *fdserlck, *fdserlcknew;
     long unsigned int PID;
     int bWrite, bRead;
@@ -442,7 +624,7 @@ void AddSerLock(const char *szttyDevice, const char *devLCKfile, const long unsi
     }
 }
 
-void exit_error(modbus_t *ctx)
+void exit_error(bus_t *bus)
 {
 /*
       // Wait for line settle
@@ -450,11 +632,11 @@ void exit_error(modbus_t *ctx)
       usleep(1000 * settle_time);
       log_message(debug_flag, "Flushed %d bytes", modbus_flush(ctx));
 */
-      modbus_close(ctx);
-      modbus_free(ctx);
-      ClrSerLock(PID);
-      free(devLCKfile);
-      free(devLCKfileNew);
+      modbus_close(bus->ctx);
+      modbus_free(bus->ctx);
+      unlockBus(bus);
+      free(bus->devLCKfile);
+      free(bus->devLCKfileNew);
       if (!metern_flag) {
         printf("NOK\n");
         log_message(debug_flag | DEBUG_SYSLOG, "NOK");
@@ -463,14 +645,56 @@ void exit_error(modbus_t *ctx)
       exit(EXIT_FAILURE);
 }
 
-float getMeasureFloat(modbus_t *ctx, int address, int retries, int nb, float divisor) {
+/*--------------------------------------------------------------------------
+    setResponseTimeout
+----------------------------------------------------------------------------*/
+void setResponseTimeout(modbus_t *ctx, long usecs) {
+
+#if LIBMODBUS_VERSION_MAJOR >= 3 && LIBMODBUS_VERSION_MINOR >= 1 && LIBMODBUS_VERSION_MICRO >= 2
+    modbus_set_response_timeout(ctx, usecs / 1000000, usecs % 1000000);
+#else
+    struct timeval timeout;
+
+    timeout.tv_sec = usecs / 1000000;
+    timeout.tv_usec = usecs % 1000000;
+    modbus_set_response_timeout(ctx, &timeout);
+#endif
+}
+
+/*--------------------------------------------------------------------------
+    classifyError
+    Map the errno of a failed modbus request to an ST_ class.
+----------------------------------------------------------------------------*/
+int classifyError(int err) {
+
+    if (err == ETIMEDOUT) return ST_TIMEOUT;
+    if (err == EMBBADCRC || err == EMBBADDATA) return ST_CRC;
+#ifdef EMBBADSLAVE
+    if (err == EMBBADSLAVE) return ST_CRC;      // reply from another slave, garbled address
+#endif
+    if (err >= EMBXILFUN && err <= EMBXGTAR) return ST_EXCEPTION;
+    return ST_ERROR;
+}
+
+/*--------------------------------------------------------------------------
+    getMeasureBlock
+    Read nb contiguous input registers starting at address in one request.
+    With rto > 0 the response timeout is rto, doubled on every retry.
+    Timeouts are retried after a jittered exponential backoff, CRC and
+    framing errors at once, exceptions not at all.
+    The round trip of the good request goes to *rtt.
+    Returns -1 with errno of the last error when every retry failed.
+----------------------------------------------------------------------------*/
+int getMeasureBlock(modbus_t *ctx, int address, int retries, int nb, uint16_t *tab_reg, long rto, long *rtt) {
 
-    uint16_t tab_reg[nb];
     int rc = -1;
     int i;
     int j = 0;
     int exit_loop = 0;
     int errno_save=0;
+    int st;
+    long backoff;
+    unsigned seed = PID ^ address ^ (unsigned)time(NULL);
     struct timeval tvStart, tvStop;
 
     while (j < retries && exit_loop == 0) {
@@ -481,33 +705,50 @@ float getMeasureFloat(modbus_t *ctx, int address, int retries, int nb, float div
         usleep(command_delay);
       }
 
-      log_message(debug_flag, "%d/%d. Register Address %d [%04X]", j, retries, 30000+address+1, address);
+      if (rto > 0) {
+        log_message(debug_flag, "Response timeout: %ldus", rto);
+        setResponseTimeout(ctx, rto);
+        rto = (rto*2 < RTO_MAX ? rto*2 : RTO_MAX);
+      }
+
+      log_message(debug_flag, "%d/%d. Register Address %d [%04X], %d registers", j, retries, 30000+address+1, address, nb);
       gettimeofday(&tvStart, NULL); 
       rc = modbus_read_input_registers(ctx, address, nb, tab_reg);
       errno_save = errno;
       gettimeofday(&tvStop, NULL); 
 
       if (rc == -1) {
+        st = classifyError(errno_save);
         if (trace_flag) fprintf(stderr, "%s: ERROR (%d) %s, %d/%d\n", programName, errno_save, modbus_strerror(errno_save), j, retries);
-        log_message(debug_flag | ( j==retries ? DEBUG_SYSLOG : 0), "ERROR (%d) %s, %d/%d, Address %d [%04X]", errno_save, modbus_strerror(errno_save), j, retries, 30000+address+1, address);
+        log_message(debug_flag | ( j==retries || st == ST_EXCEPTION ? DEBUG_SYSLOG : 0), "ERROR (%d) %s, %d/%d, Address %d [%04X]", errno_save, modbus_strerror(errno_save), j, retries, 30000+address+1, address);
         log_message(debug_flag | ( j==retries ? DEBUG_SYSLOG : 0), "Response timeout gave up after %ldus", tv_diff(&tvStop, &tvStart));
         /* libmodbus already flushes 
         log_message(debug_flag, "Flushing modbus buffer");
         log_message(debug_flag, "Flushed %d bytes", modbus_flush(ctx));
         */
-        if (command_delay) {
-          log_message(debug_flag, "Sleeping command delay: %ldus", command_delay);
-          usleep(command_delay);
+        if (st == ST_EXCEPTION) {
+          // The meter answered, asking again gets the same answer
+          exit_loop = 1;
+        } else if (j < retries && st == ST_CRC) {
+          log_message(debug_flag, "Retrying at once");
+        } else if (j < retries) {
+          backoff = (BACKOFF_BASE << (j < 16 ? j-1 : 15));
+          if (backoff > BACKOFF_MAX) backoff = BACKOFF_MAX;
+          backoff = backoff/2 + rand_r(&seed) % (backoff/2 + 1);
+          log_message(debug_flag, "Backing off: %ldus", backoff);
+          usleep(backoff);
         }
       } else {
         log_message(debug_flag, "Read time: %ldus", tv_diff(&tvStop, &tvStart));
+        if (rtt != NULL) *rtt = tv_diff(&tvStop, &tvStart);
         exit_loop = 1;
       }
 
     }
 
     if (rc == -1) {
-      exit_error(ctx);
+      errno = errno_save;
+      return -1;
     }
 
     if (debug_flag) {
@@ -516,20 +757,155 @@ float getMeasureFloat(modbus_t *ctx, int address, int retries, int nb, float div
        }
     }
 
-	if(i==1) {
-		tab_reg[1] = 0;
-	}
+    return rc;
+}
+
+/*--------------------------------------------------------------------------
+    getMeasureFloat
+    Decode a value from a block read by getMeasureBlock at block_start.
+----------------------------------------------------------------------------*/
+float getMeasureFloat(const uint16_t *block, int block_start, const measure_t *m) {
+
+    const uint16_t *reg = block + (m->address - block_start);
+    int32_t tmp = reg[0];
+
+    if (m->nb == 2) tmp |= (int32_t)reg[1] << 16;
+
+    return tmp / m->divisor;
+}
+
+/*--------------------------------------------------------------------------
+    decodeReading
+    Fill the values of r from its raw block.
+----------------------------------------------------------------------------*/
+void decodeReading(reading_t *r) {
+
+    int m;
+
+    for (m = 0; m < M_COUNT; m++)
+        r->value[m] = getMeasureFloat(r->reg, BLOCK_START, &measures[m]);
+    r->alarm = r->reg[ALARM - BLOCK_START];
+}
+
+/*--------------------------------------------------------------------------
+    readingComplete
+    True when every value selected by mask was read.
+----------------------------------------------------------------------------*/
+int readingComplete(const reading_t *r, unsigned mask) {
+
+    int m;
+
+    if (!r->valid) return 0;
+    for (m = 0; m < M_COUNT; m++)
+        if ((mask & MEASURE_BIT(m)) && r->status[m] != ST_OK) return 0;
+    return 1;
+}
+
+/*--------------------------------------------------------------------------
+    getReading
+    Read the measurement block of the current slave into r. When the meter
+    refuses the block, the values selected by measure_mask are read one by
+    one so a single bad register does not cost the others.
+    Returns 0 when every value came in, -1 otherwise, see r->status.
+----------------------------------------------------------------------------*/
+int getReading(modbus_t *ctx, int retries, reading_t *r) {
+
+    uint16_t block[BLOCK_SIZE];
+    int m, st;
+    int good = 0;
+
+    memset(block, 0, sizeof(block));
+    if (getMeasureBlock(ctx, BLOCK_START, retries, BLOCK_SIZE, block, r->rto, &r->rtt) != -1) {
+        for (m = 0; m < M_COUNT; m++) r->status[m] = ST_OK;
+        good = M_COUNT;
+    } else if ((st = classifyError(errno)) != ST_EXCEPTION) {
+        for (m = 0; m < M_COUNT; m++) r->status[m] = st;
+    } else {
+        log_message(debug_flag | DEBUG_SYSLOG, "Meter %d refused the block, reading values one by one", r->address);
+        for (m = 0; m < M_COUNT; m++) {
+            if (!(measure_mask & MEASURE_BIT(m))) {
+                r->status[m] = ST_UNREAD;
+            } else if (getMeasureBlock(ctx, measures[m].address, retries, measures[m].nb,
+                                       block + (measures[m].address - BLOCK_START), r->rto, &r->rtt) == -1) {
+                r->status[m] = classifyError(errno);
+            } else {
+                r->status[m] = ST_OK;
+                good++;
+            }
+        }
+    }
+
+    r->valid = (good > 0);
+    if (!r->valid) return -1;
+
+    memcpy(r->reg, block, sizeof(block));
+    clock_gettime(CLOCK_MONOTONIC, &r->taken);
+    decodeReading(r);
+    log_message(debug_flag, "Alarm status: 0x%04X", r->alarm);
+
+    return (readingComplete(r, measure_mask) ? 0 : -1);
+}
+
+/*--------------------------------------------------------------------------
+    readingTag
+    Meter address, prefixed by the bus name when several buses are read.
+----------------------------------------------------------------------------*/
+const char *readingTag(const reading_t *r, char *tag, size_t size) {
+
+    if (r->bus != NULL)
+        snprintf(tag, size, "%s/%d", r->bus, r->address);
+    else
+        snprintf(tag, size, "%d", r->address);
+    return tag;
+}
+
+/*--------------------------------------------------------------------------
+    printReading
+    Print the values selected by mask in one of the OUT_ formats. Values
+    that could not be read show as NOK with their status, IEC skips them.
+----------------------------------------------------------------------------*/
+void printReading(FILE *out, int format, const reading_t *r, unsigned mask) {
+
+    const measure_t *d;
+    char tag[64];
+    char value[32];
+    int m;
+
+    readingTag(r, tag, sizeof(tag));
 
-	int32_t tmp = tab_reg[0] | (tab_reg[1] << 16);
-    float value = tmp / divisor;
+    for (m = 0; m < M_COUNT; m++) {
+        if (!(mask & MEASURE_BIT(m))) continue;
+        d = &measures[m];
 
-    return value;
+        if (r->status[m] != ST_OK) {
+            if (format == OUT_COMPACT) {
+                fprintf(out, "NOK ");
+            } else if (format == OUT_DEFAULT) {
+                fprintf(out, "%s: NOK (%s)\n", d->label, status_names[r->status[m]]);
+            }
+            continue;
+        }
 
+        if (d->integer)
+            snprintf(value, sizeof(value), "%d", (int)r->value[m]);
+        else
+            snprintf(value, sizeof(value), "%3.2f", r->value[m]);
+
+        if (format == OUT_IEC) {
+            fprintf(out, "%s_%s(%s*%s)\n", tag, d->id, value, d->iec_unit);
+        } else if (format == OUT_COMPACT) {
+            fprintf(out, "%s ", value);
+        } else {
+            fprintf(out, "%s: %s %s%s\n", d->label, value, d->unit, d->unit[0] ? " " : "");
+        }
+    }
 }
 
 
-void changeConfigHex(modbus_t *ctx, int address, int new_value, int restart)
+void changeConfigHex(bus_t *bus, int address, int new_value, int restart)
 {
+    modbus_t *ctx = bus->ctx;
+
     if (command_delay) {
       log_message(debug_flag, "Sleeping command delay: %ldus", command_delay);
       usleep(command_delay);
@@ -543,7 +919,7 @@ void changeConfigHex(modbus_t *ctx, int address, int new_value, int restart)
         log_message(DEBUG_STDERR | DEBUG_SYSLOG, "error 1: (%d) %s, %d, %d", errno, modbus_strerror(errno), n);
         if (errno == EMBXILFUN) // Illegal function
             log_message(DEBUG_STDERR | DEBUG_SYSLOG, "Tip: is the meter in set mode?");
-        exit_error(ctx);
+        exit_error(bus);
     }
 }
 
@@ -595,9 +971,12 @@ void *getPIDcmd(long unsigned int PID)
 
 /*--------------------------------------------------------------------------
     lockSer
+    Returns -1 when the lock could not be acquired within yLockWait.
 ----------------------------------------------------------------------------*/
-void lockSer(const char *szttyDevice, const long unsigned int PID, int debug_flag)
+int lockSer(bus_t *bus, const long unsigned int PID, int debug_flag)
 {
+    const char *szttyDevice = bus->device;
+    char *devLCKfile, *devLCKfileNew = NULL;
     char *pos;
     FILE *fdserlck = NULL;
     char *COMMAND = NULL;
@@ -626,6 +1005,8 @@ void lockSer(const char *szttyDevice, const long unsigned int PID, int debug_fla
     } else {
         devLCKfile = NULL;
     }
+    bus->devLCKfile = devLCKfile;
+    bus->devLCKfileNew = devLCKfileNew;
 
     log_message(debug_flag, "szttyDevice: %s",szttyDevice);
     log_message(debug_flag, "devLCKfile: <%s>",devLCKfile);
@@ -741,7 +1122,7 @@ void lockSer(const char *szttyDevice, const long unsigned int PID, int debug_fla
                     log_message(debug_flag | (staleLockRetries > 1 ? DEBUG_SYSLOG : 0), "Stale pid lock(%d)? PID=%lu, LckPID=%lu, LckCOMMAND='%s', LckPIDCommand='%s'", staleLockRetries, PID, LckPID, LckCOMMAND, LckPIDcommand);
                 } else if (LckPID == clrStaleTargetPID && staleLockRetries >= staleLockRetriesMax) {
                     log_message(debug_flag | DEBUG_SYSLOG, "Clearing stale serial port lock. (%lu)", LckPID);
-                    ClrSerLock(LckPID);
+                    ClrSerLock(bus, LckPID);
                     staleLockRetries = 0;
                     clrStaleTargetPID = 0;
                 }
@@ -771,247 +1152,399 @@ void lockSer(const char *szttyDevice, const long unsigned int PID, int debug_fla
     free(COMMAND);
     if (LckPID == PID) log_message(debug_flag, "Appears we got the lock.");
     if (LckPID != PID) {
-        ClrSerLock(PID);
+        ClrSerLock(bus, PID);
         log_message(DEBUG_STDERR, "Problem locking serial device %s.",szttyDevice);
         log_message(DEBUG_STDERR | DEBUG_SYSLOG, "Unable to get lock on serial %s for %lu in %ds: still locked by %lu.",szttyDevice,PID,(yLockWait)%30,LckPID);
         log_message(DEBUG_STDERR, "Try a greater -w value (eg -w%u).", (yLockWait+2)%30);
-        free(devLCKfile); free(devLCKfileNew); free(PARENTCOMMAND);        
-        exit(2);
+        free(devLCKfile); free(devLCKfileNew);
+        bus->devLCKfile = bus->devLCKfileNew = NULL;
+        return -1;
     }
+    return 0;
 }
 
-int main(int argc, char* argv[])
+/*--------------------------------------------------------------------------
+    printRecord
+    Print one meter record with its OK/NOK verdict. When several meters are
+    read the record is tagged with the meter address.
+----------------------------------------------------------------------------*/
+void printRecord(FILE *out, int format, const reading_t *r, unsigned mask, int multi) {
+
+    char tag[64];
+
+    if (multi) {
+        readingTag(r, tag, sizeof(tag));
+        if (format == OUT_DEFAULT) {
+            fprintf(out, "Meter: %s\n", tag);
+        } else if (format == OUT_COMPACT) {
+            fprintf(out, "%s ", tag);
+        }
+    }
+
+    if (r->valid) {
+        printReading(out, format, r, mask);
+        if (format != OUT_IEC) fprintf(out, "%s\n", readingComplete(r, mask) ? "OK" : "NOK");
+    } else if (format != OUT_IEC) {
+        fprintf(out, "NOK\n");
+    }
+}
+
+/*--------------------------------------------------------------------------
+    getAddressList
+    Parse a meter list like "1,2,5-12" into list, in the given order and
+    without duplicates. Returns the number of addresses, 0 on error.
+----------------------------------------------------------------------------*/
+int getAddressList(const char *arg, int *list)
 {
-    int device_address = 1;
-    int new_address    = 0;
-    int power_flag     = 0;
-    int volt_flag      = 0;
-    int current_flag   = 0;
-    int freq_flag      = 0;
-    int pf_flag        = 0;
-    int total_flag     = 0;
-    int compact_flag   = 0;
-    int count_param    = 0;
-    int num_retries    = 1;
-#if LIBMODBUS_VERSION_MAJOR >= 3 && LIBMODBUS_VERSION_MINOR >= 1 && LIBMODBUS_VERSION_MICRO >= 2
-    uint32_t resp_timeout = 2;
-    uint32_t byte_timeout = -1;    
-#else
-    time_t resp_timeout = 2;
-    time_t byte_timeout = -1;
-#endif
-    char *szttyDevice  = NULL;
+    char seen[MAX_ADDRESSES+1];
+    const char *p = arg;
+    char *end;
+    long from, to, a;
+    int n = 0;
+
+    memset(seen, 0, sizeof(seen));
+    while (*p) {
+        from = strtol(p, &end, 10);
+        if (end == p) return 0;
+        to = from;
+        p = end;
+        if (*p == '-') {
+            p++;
+            to = strtol(p, &end, 10);
+            if (end == p) return 0;
+            p = end;
+        }
+        if (from < 1 || to > MAX_ADDRESSES || from > to) return 0;
+        for (a = from; a <= to; a++) {
+            if (!seen[a]) {
+                seen[a] = 1;
+                list[n++] = a;
+            }
+        }
+        if (*p == ',') p++;
+        else if (*p != '\0') return 0;
+    }
+    return n;
+}
 
-    int c;
-    int read_count     = 0;
-   
-    programName        = argv[0];
+/*--------------------------------------------------------------------------
+    futex_wait / futex_wake
+    Process shared futex on a word of the arbiter mapping.
+----------------------------------------------------------------------------*/
+static int futex_wait(_Atomic uint32_t *addr, uint32_t val, long ms)
+{
+    struct timespec ts = { ms / 1000, (ms % 1000) * 1000000L };
+    return syscall(SYS_futex, (uint32_t *)addr, FUTEX_WAIT, val, &ts, NULL, 0);
+}
 
-    if (argc == 1) {
-        usage(programName);
-        exit(EXIT_FAILURE);
+static int futex_wake(_Atomic uint32_t *addr)
+{
+    return syscall(SYS_futex, (uint32_t *)addr, FUTEX_WAKE, INT32_MAX, NULL, NULL, 0);
+}
+
+/*--------------------------------------------------------------------------
+    getSharedMap
+    Map the loc<tty> file shared by every pzem16 process using a serial
+    port, creating it zeroed if needed. All shared structures start out
+    valid when zeroed.
+----------------------------------------------------------------------------*/
+void *getSharedMap(const char *loc, const char *szttyDevice, size_t size)
+{
+    const char *pos = strrchr(szttyDevice, '/');
+    char path[strlen(loc)+strlen(szttyDevice)+1];
+    struct stat st;
+    void *map;
+    int fd;
+
+    snprintf(path, sizeof(path), "%s%s", loc, pos ? pos+1 : szttyDevice);
+    fd = open(path, O_RDWR | O_CREAT, 0644);
+    if (fd == -1) {
+        log_message(debug_flag | DEBUG_SYSLOG, "Unable to open %s: (%d) %s", path, errno, strerror(errno));
+        return NULL;
+    }
+    // Growing is idempotent, a racing creator can't hurt
+    if (fstat(fd, &st) == -1 || (st.st_size < size && ftruncate(fd, size) == -1)) {
+        log_message(debug_flag | DEBUG_SYSLOG, "Unable to size %s: (%d) %s", path, errno, strerror(errno));
+        close(fd);
+        return NULL;
+    }
+    map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        log_message(debug_flag | DEBUG_SYSLOG, "Unable to map %s: (%d) %s", path, errno, strerror(errno));
+        return NULL;
     }
+    log_message(debug_flag, "Mapped %s", path);
+    return map;
+}
 
-    srand(getpid()^time(NULL));      // Init random numbers
+/*--------------------------------------------------------------------------
+    pidAlive
+    A zombie still answers kill(), it can't hold the bus anymore though.
+----------------------------------------------------------------------------*/
+static int pidAlive(pid_t pid)
+{
+    char path[32], stat[64];
+    char *p;
+    ssize_t n;
+    int fd;
 
-    PID = getpid();
-    getCmdLine();
+    if (kill(pid, 0) == -1 && errno == ESRCH) return 0;
 
-    PPID = getppid();
-    PARENTCOMMAND = getPIDcmd(PPID); 
+    snprintf(path, sizeof(path), "/proc/%d/stat", pid);
+    if ((fd = open(path, O_RDONLY)) == -1) return 1;
+    n = read(fd, stat, sizeof(stat)-1);
+    close(fd);
+    if (n <= 0) return 1;
+    stat[n] = '\0';
+    p = strrchr(stat, ')');
+    return !(p != NULL && p[1] == ' ' && p[2] == 'Z');
+}
 
-    opterr = 0;
+/*--------------------------------------------------------------------------
+    arbiterSkip
+    Move serving past ticket s when its owner is gone. Returns 1 if moved.
+----------------------------------------------------------------------------*/
+static int arbiterSkip(arbiter_t *arb, uint32_t s, struct timespec *unseen)
+{
+    uint64_t slot = atomic_load(&arb->slot[s % ARB_SLOTS]);
+    struct timespec now;
+    pid_t pid = slot & 0xFFFFFFFF;
+
+    if ((uint32_t)(slot >> 32) != s) {
+        // Ticket taken but not registered yet: give its owner a second
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        if (unseen->tv_sec == 0) {
+            *unseen = now;
+            return 0;
+        }
+        if (ts_diff_ms(&now, unseen) < 1000) return 0;
+        log_message(debug_flag | DEBUG_SYSLOG, "Bus ticket %u never registered, skipping", s);
+    } else if (pid != 0 && (pid == getpid() || pidAlive(pid))) {
+        return 0;
+    } else if (pid != 0) {
+        log_message(debug_flag | DEBUG_SYSLOG, "Bus holder %d of ticket %u is dead, skipping", pid, s);
+    }
 
-    while ((c = getopt (argc, argv, "a:Ab:BcCd:D:efgij:lmM:nN:oOpP:qr:R:s:S:tTvw:W:xy:z:12")) != -1) {
-        log_message(debug_flag | DEBUG_SYSLOG, "optind = %d, argc = %d, c = %c, optarg = %s", optind, argc, c, optarg);
+    unseen->tv_sec = 0;
+    if (atomic_compare_exchange_strong(&arb->serving, &s, s+1)) futex_wake(&arb->serving);
+    return 1;
+}
 
-        switch (c)
-        {
-            case 'a':
-                device_address = atoi(optarg);
+/*--------------------------------------------------------------------------
+    lockBus
+    Take our ticket and sleep on the futex until it is served, at most
+    yLockWait seconds. Returns -1 on timeout.
+----------------------------------------------------------------------------*/
+int lockBus(bus_t *bus)
+{
+    struct timespec tStart, tNow, unseen = { 0, 0 };
+    uint32_t s, t;
+    long left;
+
+    if (bus->arb == NULL) bus->arb = getSharedMap(ttyARBloc, bus->device, sizeof(arbiter_t));
+    if (bus->arb == NULL) {
+        // No shared memory, the lock file is all we have
+        log_message(debug_flag | DEBUG_SYSLOG, "Falling back to lock file for %s", bus->device);
+        if (lockSer(bus, PID, debug_flag) == -1) return -1;
+        bus->LCKheld = 1;
+        return 0;
+    }
 
-                if (!(0 < device_address && device_address <= 247)) {
-                    fprintf (stderr, "%s: Address must be between 1 and 247.\n", programName);
-                    exit(EXIT_FAILURE);
-                }
-                log_message(debug_flag | DEBUG_SYSLOG, "device_address = %d", device_address);
-                break;
-            case 'v':
-                volt_flag = 1;
-                count_param++;
-                log_message(debug_flag | DEBUG_SYSLOG, "volt_flag = %d, count_param = %d", volt_flag, count_param);
-                break;
-            case 'p':
-                power_flag = 1;
-                count_param++;
-                log_message(debug_flag | DEBUG_SYSLOG, "power_flag = %d, count_param = %d", power_flag, count_param);
-                break;
-            case 'c':
-                current_flag = 1;
-                count_param++;
-                log_message(debug_flag | DEBUG_SYSLOG, "current_flag = %d, count_param = %d", current_flag, count_param);
-                break;
-            case 't':
-                total_flag = 1;
-                count_param++;
-                log_message(debug_flag | DEBUG_SYSLOG, "total_flag = %d, count_param = %d", total_flag, count_param);
-                break;
-            case 'f':
-                freq_flag = 1;
-                count_param++;
-                log_message(debug_flag | DEBUG_SYSLOG, "freq_flag = %d, count_param = %d", freq_flag, count_param);
-                break;
-            case 'g':
-                pf_flag = 1;
-                count_param++;
-                log_message(debug_flag | DEBUG_SYSLOG, "pf_flag = %d, count_param = %d", pf_flag, count_param);
-                break;
-            case 'd':
-                switch (*optarg) {
-                    case '0':
-                    case '1':
-                    case '2':
-                    case '3':
-                        debug_flag = atoi(optarg) & DEBUG_STDERR;
-                        debug_mask = atoi(optarg);
-                        break;
-                    default:
-                         fprintf (stderr, "%s: Debug value must be one of 0,1,2,3.\n", programName);
-                         exit(EXIT_FAILURE);
-                }
-                log_message(debug_flag | DEBUG_SYSLOG, "debug_flag = %d", debug_flag);
-                break;
-            case 'x':
-                trace_flag = 1;
-                log_message(debug_flag | DEBUG_SYSLOG, "trace_flag = %d, count_param = %d", trace_flag, count_param);
-                break;
-            case 's':
-                new_address = atoi(optarg);
-                if (!(0 < new_address && new_address <= 247)) {
-                    fprintf (stderr, "%s: New address (%d) out of range, 1-247.\n", programName, new_address);
-                    exit(EXIT_FAILURE);
-                }
-                log_message(debug_flag | DEBUG_SYSLOG, "new_address = %d, count_param = %d", new_address, count_param);
-                break;
-            case 'm':
-                metern_flag = 1;
-                log_message(debug_flag | DEBUG_SYSLOG, "metern_flag = %d, count_param = %d", metern_flag, count_param);
-                break;
-            case 'q':
-                compact_flag = 1;
-                log_message(debug_flag | DEBUG_SYSLOG, "compact_flag = %d, count_param = %d", compact_flag, count_param);
-                break;
-            case 'z':
-                num_retries = atoi(optarg);
-                if (!(0 < num_retries && num_retries <= MAX_RETRIES)) {
-                    fprintf (stderr, "%s: num_retries (%d) out of range, 1-%d.\n", programName, num_retries, MAX_RETRIES);
-                    exit(EXIT_FAILURE);
-                }
-                log_message(debug_flag | DEBUG_SYSLOG, "num_retries = %d, count_param = %d", num_retries, count_param);
-                break;
-            case 'j':
-                resp_timeout = atoi(optarg);
-                if (resp_timeout < 1 || resp_timeout > 500) {
-                    fprintf(stderr, "%s: -j Response timeout (%lu) out of range, 0-500.\n",programName,(long unsigned)resp_timeout);
-                    exit(EXIT_FAILURE);
-                }
-                log_message(debug_flag | DEBUG_SYSLOG, "resp_timeout = %d, count_param = %d", resp_timeout, count_param);
-                break;
-            case 'y':
-                byte_timeout = atoi(optarg);
-                if (byte_timeout < 1 || byte_timeout > 500) {
-                    fprintf(stderr, "%s: -y Byte timeout (%lu) out of range, 1-500.\n",programName,(long unsigned)byte_timeout);
-                    exit(EXIT_FAILURE);
-                }
-                log_message(debug_flag | DEBUG_SYSLOG, "byte_timeout = %d, count_param = %d", byte_timeout, count_param);
-                break;
-            case 'w':
-                yLockWait = atoi(optarg);
-                if (yLockWait < 1 || yLockWait > 30) {
-                    fprintf(stderr, "%s: -w Lock Wait seconds (%d) out of range, 1-30.\n",programName,yLockWait);
-                    exit(EXIT_FAILURE);
-                }
-                log_message(debug_flag | DEBUG_SYSLOG, "yLockWait = %d, count_param = %d", yLockWait, count_param);
-                break;
-            case 'W':
-                settle_time = atoi(optarg);
-                log_message(debug_flag | DEBUG_SYSLOG, "settle_time = %d, count_param = %d", settle_time, count_param);
-                break;
-            case 'D':
-                command_delay = atoi(optarg);
-                log_message(debug_flag | DEBUG_SYSLOG, "command_delay = %d, count_param = %d", command_delay, count_param);
-                break;
-            case '?':
-                if (isprint (optopt)) {
-                    fprintf (stderr, "%s: Unknown option `-%c'.\n", programName, optopt);
-                    usage(programName);
-                    exit(EXIT_FAILURE);
-                } else {
-                    fprintf (stderr,"%s: Unknown option character `\\x%x'.\n",programName, optopt);
-                    usage(programName);
-                    exit(EXIT_FAILURE);
-                }
-            default:
-                fprintf (stderr, "%s: Unknown option `-%c'.\n", programName, optopt);
-                usage(programName);
-                exit(EXIT_FAILURE);
+    t = atomic_fetch_add(&bus->arb->next, 1);
+    atomic_store(&bus->arb->slot[t % ARB_SLOTS], (uint64_t)t << 32 | (uint32_t)getpid());
+    bus->ticket = t;
+    log_message(debug_flag, "Bus ticket %u, %u ahead", t, t - atomic_load(&bus->arb->serving));
+
+    clock_gettime(CLOCK_MONOTONIC, &tStart);
+    while ((s = atomic_load(&bus->arb->serving)) != t) {
+        if (arbiterSkip(bus->arb, s, &unseen)) continue;
+
+        clock_gettime(CLOCK_MONOTONIC, &tNow);
+        left = yLockWait*1000L - ts_diff_ms(&tNow, &tStart);
+        if (left <= 0) {
+            // Give our ticket up, pass the bus on if it reached us meanwhile
+            atomic_store(&bus->arb->slot[t % ARB_SLOTS], (uint64_t)t << 32);
+            s = t;
+            if (atomic_compare_exchange_strong(&bus->arb->serving, &s, t+1)) {
+                futex_wake(&bus->arb->serving);
+            }
+            log_message(DEBUG_STDERR, "Problem locking serial device %s.", bus->device);
+            log_message(DEBUG_STDERR | DEBUG_SYSLOG, "Unable to get lock on serial %s for %lu in %ds: still locked by ticket %u.", bus->device, PID, yLockWait, s);
+            log_message(DEBUG_STDERR, "Try a greater -w value (eg -w%u).", (yLockWait+2)%30);
+            return -1;
         }
+        futex_wait(&bus->arb->serving, s, left < ARB_CHECK_MS ? left : ARB_CHECK_MS);
     }
+    log_message(debug_flag, "Bus ticket %u served", t);
+
+    if (legacy_lock) {
+        // Tools that only know the LCK.. file queue there
+        if (lockSer(bus, PID, debug_flag) == -1) {
+            atomic_store(&bus->arb->serving, t+1);
+            futex_wake(&bus->arb->serving);
+            return -1;
+        }
+        bus->LCKheld = 1;
+    }
+    return 0;
+}
 
-    log_message(debug_flag, "cmdline=\"%s\"", cmdline);
-        
-    if (optind < argc) {               /* get serial device name */
-        szttyDevice = argv[optind];
-     } else {
-        log_message(debug_flag, "optind = %d, argc = %d", optind, argc);
-        usage(programName);
-        fprintf(stderr, "%s: No serial device specified\n", programName);
-        exit(EXIT_FAILURE);
+/*--------------------------------------------------------------------------
+    unlockBus
+    Hand the bus to the next ticket.
+----------------------------------------------------------------------------*/
+void unlockBus(bus_t *bus)
+{
+    if (bus->LCKheld) {
+        ClrSerLock(bus, PID);
+        bus->LCKheld = 0;
     }
+    if (bus->arb != NULL) {
+        atomic_store(&bus->arb->slot[bus->ticket % ARB_SLOTS], (uint64_t)bus->ticket << 32);
+        atomic_store(&bus->arb->serving, bus->ticket+1);
+        futex_wake(&bus->arb->serving);
+        log_message(debug_flag, "Bus ticket %u released", bus->ticket);
+    }
+}
 
-    if (compact_flag == 1 && metern_flag == 1) {
-        fprintf(stderr, "%s: Parameter -m and -q are mutually exclusive\n", programName);
-        usage(programName);
-        exit(EXIT_FAILURE);
+/*--------------------------------------------------------------------------
+    publishReading
+    Seqlock writer, serialised by the bus lock.
+----------------------------------------------------------------------------*/
+void publishReading(cache_t *cache, const reading_t *r)
+{
+    cache_entry_t *e = &cache->entry[r->address];
+    uint32_t okmask = 0;
+    int m;
+    // Odd already if a writer died halfway, then it just stays odd
+    uint32_t seq = atomic_load_explicit(&e->seq, memory_order_relaxed) | 1;
+
+    for (m = 0; m < M_COUNT; m++)
+        if (r->valid && r->status[m] == ST_OK) okmask |= MEASURE_BIT(m);
+
+    atomic_store_explicit(&e->seq, seq, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    e->okmask = okmask;
+    if (okmask) {
+        e->taken = r->taken.tv_sec*1000000000LL + r->taken.tv_nsec;
+        memcpy(e->reg, r->reg, sizeof(e->reg));
     }
+    atomic_store_explicit(&e->seq, seq+1, memory_order_release);
+}
 
-    lockSer(szttyDevice, PID, debug_flag);
+/*--------------------------------------------------------------------------
+    getCachedReading
+    Seqlock reader: fill r from the cache if it holds the values of
+    measure_mask, not older than max_age ms. Returns 0 on a hit.
+----------------------------------------------------------------------------*/
+int getCachedReading(cache_t *cache, reading_t *r, long max_age)
+{
+    cache_entry_t *e = &cache->entry[r->address];
+    struct timespec now;
+    uint32_t seq;
+    uint32_t okmask;
+    int64_t taken;
+    int spins = 0;
+    int m;
 
-    modbus_t *ctx;
-    
-    // Response timeout
-    resp_timeout *= 100000;    
-    log_message(debug_flag, "resp_timeout=%ldus", resp_timeout);
-    
-    // Byte timeout
-    if (byte_timeout != -1) {
-        byte_timeout *= 1000;    
-        log_message(debug_flag, "byte_timeout=%ldus", byte_timeout);
+    do {
+        while ((seq = atomic_load_explicit(&e->seq, memory_order_acquire)) & 1) {
+            if (++spins > 10000) return -1;      // writer died halfway
+        }
+        okmask = e->okmask;
+        taken = e->taken;
+        memcpy(r->reg, e->reg, sizeof(r->reg));
+        atomic_thread_fence(memory_order_acquire);
+    } while (atomic_load_explicit(&e->seq, memory_order_relaxed) != seq);
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    if (seq == 0 || taken == 0 || (okmask & measure_mask) != measure_mask || (now.tv_sec*1000000000LL + now.tv_nsec - taken)/1000000 > max_age) {
+        return -1;
     }
-    
-    // Command delay
-    if (command_delay == -1) {
-        command_delay = 0;      // default = no command delay
-    } else { 
-        command_delay *= 1000;        
-        log_message(debug_flag, "command_delay=%ldus", command_delay);
+
+    r->taken.tv_sec = taken / 1000000000LL;
+    r->taken.tv_nsec = taken % 1000000000LL;
+    decodeReading(r);
+    for (m = 0; m < M_COUNT; m++)
+        r->status[m] = (okmask & MEASURE_BIT(m) ? ST_OK : ST_UNREAD);
+    r->valid = 1;
+    log_message(debug_flag, "Meter %d from cache, values 0x%02X, %lldms old", r->address, okmask, (now.tv_sec*1000000000LL + now.tv_nsec - taken)/1000000);
+    return 0;
+}
+
+/*--------------------------------------------------------------------------
+    updateRTT / getRTO
+    Round trip estimator of a meter (RFC 6298), kept in its cache entry so
+    every run benefits from the previous ones.
+----------------------------------------------------------------------------*/
+void updateRTT(cache_entry_t *e, long rtt)
+{
+    if (e->srtt == 0) {
+        e->srtt = rtt;
+        e->rttvar = rtt / 2;
+    } else {
+        e->rttvar = (3 * e->rttvar + labs(e->srtt - rtt)) / 4;
+        e->srtt = (7 * e->srtt + rtt) / 8;
     }
+    log_message(debug_flag, "RTT %ldus, srtt %dus, rttvar %dus", rtt, e->srtt, e->rttvar);
+}
 
-    // Settle time delay
-    if (settle_time == -1)
-        settle_time = 0;        // default = no settle time
-    else {
-        settle_time *= 1000;
-        log_message(debug_flag, "settle_time=%ldus", settle_time);
+long getRTO(const cache_entry_t *e)
+{
+    long rto = e->srtt + (RTO_K * e->rttvar > RTO_MARGIN ? RTO_K * e->rttvar : RTO_MARGIN);
+
+    return (rto < RTO_MAX ? rto : RTO_MAX);
+}
+
+/*--------------------------------------------------------------------------
+    readMeter
+    Read one meter of an open bus and publish the result.
+----------------------------------------------------------------------------*/
+int readMeter(bus_t *bus, reading_t *r)
+{
+    cache_entry_t *e = (bus->cache != NULL ? &bus->cache->entry[r->address] : NULL);
+    int rc;
+
+    r->rto = 0;
+    if (adaptive_timeout && e != NULL) {
+        if (e->srtt) {
+            r->rto = getRTO(e);
+        } else {
+            // Never answered: plain -j, the previous meter may have left its own
+            setResponseTimeout(bus->ctx, resp_timeout);
+        }
     }
 
+    modbus_set_slave(bus->ctx, r->address);
+    rc = getReading(bus->ctx, num_retries, r);
+    if (e != NULL) {
+        if (r->valid) updateRTT(e, r->rtt);
+        publishReading(bus->cache, r);
+    }
+    return rc;
+}
+
+/*--------------------------------------------------------------------------
+    openBus
+    Lock the serial port and connect the modbus context of a bus.
+    Returns 0, or the exit code of the failure: 2 for lock problems,
+    EXIT_FAILURE for modbus problems.
+----------------------------------------------------------------------------*/
+int openBus(bus_t *bus)
+{
+    modbus_t *ctx;
+
+    if (bus->cache == NULL) bus->cache = getSharedMap(ttyCACHEloc, bus->device, sizeof(cache_t));
+    if (lockBus(bus) == -1) return 2;
+
     //--- Modbus Setup start ---
     
-    ctx = modbus_new_rtu(szttyDevice, 9600, 'N', 8, 1);
+    ctx = modbus_new_rtu(bus->device, 9600, 'N', 8, 1);
     if (ctx == NULL) {
         log_message(debug_flag | DEBUG_SYSLOG, "Unable to create the libmodbus context\n");
-        ClrSerLock(PID);
-        exit(EXIT_FAILURE);
+        unlockBus(bus);
+        return EXIT_FAILURE;
     } else {
         log_message(debug_flag, "Libmodbus context open (9600N1)");
     }
@@ -1066,148 +1599,752 @@ int main(int argc, char* argv[])
         modbus_set_debug(ctx, 1);
     }
 
-    modbus_set_slave(ctx, device_address);
+    modbus_set_slave(ctx, bus->readings[0].address);
 
     if (modbus_connect(ctx) == -1) {
         log_message(DEBUG_STDERR | DEBUG_SYSLOG, "Connection failed: (%d) %s\n", errno, modbus_strerror(errno));
         modbus_free(ctx);
-        ClrSerLock(PID);
-        exit(EXIT_FAILURE);
+        unlockBus(bus);
+        return EXIT_FAILURE;
     }
 
     //log_message(debug_flag, "Flushed %d bytes", modbus_flush(ctx)); // Already flushed by connect 
 
-    float voltage     = 0;
-    float current     = 0;
-    float power       = 0;
-    float pf          = 0;
-    float freq        = 0;
-    float tot_energy  = 0;
+    bus->ctx = ctx;
+    return 0;
+}
 
-	if (new_address > 0) {
+/*--------------------------------------------------------------------------
+    closeBus
+----------------------------------------------------------------------------*/
+void closeBus(bus_t *bus)
+{
+    // log_message(debug_flag, "Flushed %d bytes", modbus_flush(ctx));
+    modbus_close(bus->ctx);
+    modbus_free(bus->ctx);
+    bus->ctx = NULL;
+    unlockBus(bus);
+    free(bus->devLCKfile);
+    free(bus->devLCKfileNew);
+    bus->devLCKfile = bus->devLCKfileNew = NULL;
+}
 
-        log_message(DEBUG_STDERR, "new_address = %d > 0, count_param = %d", new_address, count_param);
+/*--------------------------------------------------------------------------
+    readBus
+    Read every meter of a bus once and print the records. Meters with a
+    cached reading younger than max_age_ms are answered from the cache, the
+    bus is locked only if some are stale. Returns the openBus() failure,
+    before printing anything.
+----------------------------------------------------------------------------*/
+int readBus(bus_t *bus, FILE *out)
+{
+    int stale = bus->count;
+    int rc, i;
 
-        if (count_param > 0) {
-            usage(programName);
-            modbus_close(ctx);
-            modbus_free(ctx);
-            ClrSerLock(PID);
-            exit(EXIT_FAILURE);
-        } else {
-            // change Address
-            log_message(debug_flag, "Before change Address\n");
-            changeConfigHex(ctx, DEVICE_ID, new_address, RESTART_FALSE);
-            modbus_close(ctx);
-            modbus_free(ctx);
-            ClrSerLock(PID);
-            return 0;
+    if (max_age_ms > 0) {
+        if (bus->cache == NULL) bus->cache = getSharedMap(ttyCACHEloc, bus->device, sizeof(cache_t));
+        for (i = 0, stale = 0; i < bus->count; i++) {
+            if (bus->cache == NULL || getCachedReading(bus->cache, &bus->readings[i], max_age_ms) == -1) stale++;
         }
-    } else if (power_flag   == 0 &&
-               volt_flag    == 0 &&
-               current_flag == 0 &&
-               pf_flag      == 0 &&
-               freq_flag    == 0 &&
-               total_flag   == 0
-       ) {
-       // if no parameter, retrieve all values
-        power_flag   = 1;
-        volt_flag    = 1;
-        current_flag = 1;
-        freq_flag    = 1;
-        pf_flag      = 1;
-        total_flag   = 1;
-        count_param  = power_flag + volt_flag + 
-                       current_flag + freq_flag + pf_flag + 
-                       total_flag;
-    }
-
-    if (volt_flag == 1) {
-        voltage = getMeasureFloat(ctx, VOLTAGE, num_retries, 1, 10.0f);
-        read_count++;
-        if (metern_flag == 1) {
-            printf("%d_V(%3.2f*V)\n", device_address, voltage);
-        } else if (compact_flag == 1) {
-            printf("%3.2f ", voltage);
-        } else {
-            printf("Voltage: %3.2f V \n",voltage);
+    }
+
+    if (stale) {
+        if ((rc = openBus(bus)) != 0) return rc;
+        // One request for every value per meter, one lock and connection for the bus
+        for (i = 0; i < bus->count; i++) {
+            if (!bus->readings[i].valid) readMeter(bus, &bus->readings[i]);
         }
+        closeBus(bus);
     }
 
-    if (current_flag == 1) {
-        current  = getMeasureFloat(ctx, CURRENT, num_retries, 2, 1000.0f);
-        read_count++;
-        if (metern_flag == 1) {
-            printf("%d_C(%3.2f*A)\n", device_address, current);
-        } else if (compact_flag == 1) {
-            printf("%3.2f ", current);
-        } else {
-            printf("Current: %3.2f A \n",current);
+    for (i = 0; i < bus->count; i++) {
+        if (!readingComplete(&bus->readings[i], measure_mask)) {
+            log_message(debug_flag | DEBUG_SYSLOG, "Meter %d on %s: NOK", bus->readings[i].address, bus->device);
+            bus->failed++;
         }
+        printRecord(out, output_format, &bus->readings[i], measure_mask, bus->count > 1 || bus->readings[i].bus != NULL);
     }
+    return 0;
+}
 
-    if (power_flag == 1) {
-        power = getMeasureFloat(ctx, POWER, num_retries, 2, 10.0f);
-        read_count++;
-        if (metern_flag == 1) {
-            printf("%d_P(%3.2f*W)\n", device_address, power);
-        } else if (compact_flag == 1) {
-            printf("%3.2f ", power);
-        } else {
-            printf("Power: %3.2f W \n", power);
+/*--------------------------------------------------------------------------
+    readBusWorker
+    Thread running readBus, rendering the records in bus->output.
+----------------------------------------------------------------------------*/
+void *readBusWorker(void *arg)
+{
+    bus_t *bus = arg;
+    FILE *out;
+    int i;
+
+    out = open_memstream(&bus->output, &bus->output_size);
+    if (out == NULL) {
+        log_message(DEBUG_STDERR | DEBUG_SYSLOG, "Unable to buffer output for %s", bus->device);
+        bus->failed = bus->count;
+        return NULL;
+    }
+
+    if (readBus(bus, out) != 0) {
+        // Bus unusable, what the cache had is all we have
+        for (i = 0; i < bus->count; i++) {
+            if (!readingComplete(&bus->readings[i], measure_mask)) bus->failed++;
+            printRecord(out, output_format, &bus->readings[i], measure_mask, 1);
         }
     }
 
-    if (pf_flag == 1) {
-        pf = getMeasureFloat(ctx, PFACTOR, num_retries, 1, 1.0f);
-        read_count++;
-        if (metern_flag == 1) {
-            printf("%d_PF(%3.2f*F)\n", device_address, pf);
-        } else if (compact_flag == 1) {
-            printf("%3.2f ", pf);
-        } else {
-            printf("Power Factor: %3.2f \n", pf);
+    fclose(out);
+    return NULL;
+}
+
+/*--------------------------------------------------------------------------
+    sig_terminate
+----------------------------------------------------------------------------*/
+static void sig_terminate(int sig)
+{
+    terminate = 1;
+}
+
+/*--------------------------------------------------------------------------
+    openServerSocket
+    Listen on a Unix domain socket, replacing a stale one left behind.
+----------------------------------------------------------------------------*/
+int openServerSocket(const char *path)
+{
+    struct sockaddr_un addr;
+    int fd;
+
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        log_message(DEBUG_STDERR | DEBUG_SYSLOG, "Socket path too long: %s", path);
+        return -1;
+    }
+
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd == -1) {
+        log_message(DEBUG_STDERR | DEBUG_SYSLOG, "Unable to create socket: (%d) %s", errno, strerror(errno));
+        return -1;
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+    unlink(path);
+
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1 || listen(fd, 16) == -1) {
+        log_message(DEBUG_STDERR | DEBUG_SYSLOG, "Unable to listen on %s: (%d) %s", path, errno, strerror(errno));
+        close(fd);
+        return -1;
+    }
+    chmod(path, 0666);          // readings are not a secret, let any user query them
+
+    log_message(debug_flag, "Listening on %s", path);
+    return fd;
+}
+
+/*--------------------------------------------------------------------------
+    serveClient
+    Answer one "GET <format> <mask> [addresses]" request from the latest
+    readings of every bus.
+----------------------------------------------------------------------------*/
+void serveClient(int fd, const bus_t *buses, int nbus, long stale_ms)
+{
+    struct timeval tv = { 0, 100000 };
+    struct timespec now;
+    char request[1024];
+    char list[1024] = "";
+    int wanted[MAX_ADDRESSES];
+    int nwanted = 0;
+    int format = OUT_DEFAULT;
+    unsigned mask = MEASURE_ALL;
+    int count = 0;
+    int found;
+    reading_t r;
+    ssize_t n;
+    FILE *out;
+    int b, i, j;
+
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    n = read(fd, request, sizeof(request)-1);
+    if (n <= 0) {
+        close(fd);
+        return;
+    }
+    request[n] = '\0';
+
+    if (sscanf(request, "GET %d %x %1023s", &format, &mask, list) < 1 ||
+        (list[0] != '\0' && (nwanted = getAddressList(list, wanted)) == 0)) {
+        log_message(debug_flag, "Bad request: %s", request);
+        close(fd);
+        return;
+    }
+    mask &= MEASURE_ALL;
+
+    out = fdopen(fd, "w");
+    if (out == NULL) {
+        close(fd);
+        return;
+    }
+
+    for (b = 0; b < nbus; b++) count += buses[b].count;
+    if (nwanted) count = nwanted * nbus;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    if (nwanted) {
+        for (i = 0; i < nwanted; i++) {
+            found = 0;
+            for (b = 0; b < nbus; b++) {
+                for (j = 0; j < buses[b].count && buses[b].readings[j].address != wanted[i]; j++);
+                if (j == buses[b].count) continue;
+                pthread_mutex_lock(&readings_mutex);
+                r = buses[b].readings[j];
+                pthread_mutex_unlock(&readings_mutex);
+                if (r.valid && ts_diff_ms(&now, &r.taken) > stale_ms) r.valid = 0;
+                printRecord(out, format, &r, mask, count > 1);
+                found = 1;
+            }
+            if (!found) {
+                // not polled by this daemon
+                memset(&r, 0, sizeof(r));
+                r.address = wanted[i];
+                printRecord(out, format, &r, mask, count > 1);
+            }
+        }
+    } else {
+        for (b = 0; b < nbus; b++) {
+            for (j = 0; j < buses[b].count; j++) {
+                pthread_mutex_lock(&readings_mutex);
+                r = buses[b].readings[j];
+                pthread_mutex_unlock(&readings_mutex);
+                if (r.valid && ts_diff_ms(&now, &r.taken) > stale_ms) r.valid = 0;
+                printRecord(out, format, &r, mask, count > 1);
+            }
         }
     }
+    fclose(out);
+}
 
-    if (freq_flag == 1) {
-        freq = getMeasureFloat(ctx, FREQUENCY, num_retries, 1, 10.0f);
-        read_count++;
-        if (metern_flag == 1) {
-            printf("%d_F(%3.2f*Hz)\n", device_address, freq);
-        } else if (compact_flag == 1) {
-            printf("%3.2f ", freq);
-        } else {
-            printf("Frequency: %3.2f Hz \n", freq);
+/*--------------------------------------------------------------------------
+    pollBusWorker
+    Daemon bus thread: poll every meter of the bus each interval_ms.
+----------------------------------------------------------------------------*/
+void *pollBusWorker(void *arg)
+{
+    bus_t *bus = arg;
+    struct timespec now, next;
+    reading_t r;
+    int i;
+
+    clock_gettime(CLOCK_MONOTONIC, &next);
+    while (!terminate) {
+        for (i = 0; i < bus->count && !terminate; i++) {
+            r = bus->readings[i];     // only this thread writes them
+            if (readMeter(bus, &r) == 0 || r.valid) {
+                // partial readings too, each value keeps its status
+                pthread_mutex_lock(&readings_mutex);
+                bus->readings[i] = r;
+                pthread_mutex_unlock(&readings_mutex);
+            }
+            if (!readingComplete(&r, measure_mask)) {
+                log_message(debug_flag | DEBUG_SYSLOG, "Poll of meter %d on %s failed", r.address, bus->device);
+            }
         }
+
+        next.tv_sec  += interval_ms / 1000;
+        next.tv_nsec += (interval_ms % 1000) * 1000000L;
+        if (next.tv_nsec >= 1000000000L) { next.tv_sec++; next.tv_nsec -= 1000000000L; }
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        if (ts_diff_ms(&now, &next) > 0) next = now;     // overran, don't burst to catch up
+
+        pthread_mutex_lock(&readings_mutex);
+        while (!terminate && pthread_cond_timedwait(&terminate_cond, &readings_mutex, &next) != ETIMEDOUT);
+        pthread_mutex_unlock(&readings_mutex);
     }
+    return NULL;
+}
 
-    if (total_flag == 1) {
-        tot_energy = getMeasureFloat(ctx, TAENERGY, num_retries, 2, 1.0f);
-        read_count++;
-        if (metern_flag == 1) {
-            printf("%d_TE(%d*Wh)\n", device_address, (int)tot_energy);
-        } else if (compact_flag == 1) {
-            printf("%d ", (int)tot_energy);
-        } else {
-            printf("Total Active Energy: %d Wh \n", (int)tot_energy);
+/*--------------------------------------------------------------------------
+    runDaemon
+    One polling thread per bus, this thread serves the latest readings on
+    the socket until SIGTERM/SIGINT.
+----------------------------------------------------------------------------*/
+void runDaemon(int listen_fd, bus_t *buses, int nbus)
+{
+    struct pollfd pfd;
+    sigset_t all, saved;
+    int b, fd;
+
+    // Signals are for this thread, it wakes the workers up
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, &saved);
+    for (b = 0; b < nbus; b++) {
+        if (pthread_create(&buses[b].thread, NULL, pollBusWorker, &buses[b]) != 0) {
+            log_message(DEBUG_STDERR | DEBUG_SYSLOG, "Unable to start the worker for %s", buses[b].device);
+            terminate = 1;
+            nbus = b;
+            break;
+        }
+    }
+    pthread_sigmask(SIG_SETMASK, &saved, NULL);
+
+    pfd.fd = listen_fd;
+    pfd.events = POLLIN;
+    while (!terminate) {
+        if (poll(&pfd, 1, 1000) > 0 && (pfd.revents & POLLIN)) {
+            fd = accept(listen_fd, NULL, NULL);
+            if (fd != -1) serveClient(fd, buses, nbus, 3 * interval_ms);
         }
     }
 
+    pthread_mutex_lock(&readings_mutex);
+    pthread_cond_broadcast(&terminate_cond);
+    pthread_mutex_unlock(&readings_mutex);
+    for (b = 0; b < nbus; b++) pthread_join(buses[b].thread, NULL);
 
-    if (read_count == count_param) {
-        // log_message(debug_flag, "Flushed %d bytes", modbus_flush(ctx));
-        modbus_close(ctx);
-        modbus_free(ctx);
-        ClrSerLock(PID);
-        free(devLCKfile);
-        free(devLCKfileNew);
+    log_message(debug_flag | DEBUG_SYSLOG, "Terminating daemon");
+}
+
+/*--------------------------------------------------------------------------
+    queryDaemon
+    Client side of daemon mode: print the daemon answer, no serial access.
+----------------------------------------------------------------------------*/
+int queryDaemon(const char *path, int format, unsigned mask, const char *addresses)
+{
+    struct sockaddr_un addr;
+    char buffer[1024];
+    char tail[4] = { '\n', '\n', '\n', '\n' };
+    size_t received = 0;
+    int failed = 0;
+    ssize_t n, i;
+    int fd;
+
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, path, sizeof(addr.sun_path)-1);
+
+    if (fd == -1 || connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+        log_message(DEBUG_STDERR | DEBUG_SYSLOG, "Unable to connect to %s: (%d) %s", path, errno, strerror(errno));
+        if (fd != -1) close(fd);
+        if (format != OUT_IEC) printf("NOK\n");
+        return EXIT_FAILURE;
+    }
+
+    n = snprintf(buffer, sizeof(buffer), "GET %d %x %s\n", format, mask, addresses != NULL ? addresses : "");
+    if (n >= sizeof(buffer) || write(fd, buffer, n) != n) {
+        close(fd);
+        if (format != OUT_IEC) printf("NOK\n");
+        return EXIT_FAILURE;
+    }
+
+    while ((n = read(fd, buffer, sizeof(buffer))) > 0) {
+        fwrite(buffer, 1, n, stdout);
+        // look for a NOK verdict on any meter
+        for (i = 0; i < n; i++) {
+            memmove(tail, tail+1, 3);
+            tail[3] = buffer[i];
+            if (memcmp(tail, "NOK\n", 4) == 0) failed = 1;
+        }
+        received += n;
+    }
+    close(fd);
+
+    return (received > 0 && !failed ? EXIT_SUCCESS : EXIT_FAILURE);
+}
+
+int main(int argc, char* argv[])
+{
+    int device_address = 1;
+    int addresses[MAX_ADDRESSES] = { 1 };
+    int address_count  = 1;
+    char *address_arg  = NULL;
+    int failed         = 0;
+    int i;
+    int new_address    = 0;
+    int power_flag     = 0;
+    int volt_flag      = 0;
+    int current_flag   = 0;
+    int freq_flag      = 0;
+    int pf_flag        = 0;
+    int total_flag     = 0;
+    int compact_flag   = 0;
+    int count_param    = 0;
+    bus_t buses[MAX_BUSES];
+    int nbus           = 0;
+    int daemon_flag    = 0;
+    char *socket_path  = NULL;
+    unsigned mask      = 0;
+    int rc, b;
+
+    enum { OPT_DAEMON = 256, OPT_SOCKET, OPT_INTERVAL, OPT_LCKFILE, OPT_MAXAGE, OPT_ADAPTIVE };
+    static const struct option long_options[] = {
+        { "adaptive-timeout", no_argument, NULL, OPT_ADAPTIVE },
+        { "max-age",  required_argument, NULL, OPT_MAXAGE },
+        { "lck-file", no_argument,       NULL, OPT_LCKFILE },
+        { "daemon",   no_argument,       NULL, OPT_DAEMON },
+        { "socket",   required_argument, NULL, OPT_SOCKET },
+        { "interval", required_argument, NULL, OPT_INTERVAL },
+        { NULL, 0, NULL, 0 }
+    };
+
+    int c;
+   
+    programName        = argv[0];
+
+    if (argc == 1) {
+        usage(programName);
+        exit(EXIT_FAILURE);
+    }
+
+    srand(getpid()^time(NULL));      // Init random numbers
+
+    PID = getpid();
+    getCmdLine();
+
+    PPID = getppid();
+    PARENTCOMMAND = getPIDcmd(PPID); 
+
+    opterr = 0;
+
+    while ((c = getopt_long (argc, argv, "a:Ab:BcCd:D:efgij:lmM:nN:oOpP:qr:R:s:S:tTvw:W:xy:z:12", long_options, NULL)) != -1) {
+        log_message(debug_flag | DEBUG_SYSLOG, "optind = %d, argc = %d, c = %c, optarg = %s", optind, argc, c, optarg);
+
+        switch (c)
+        {
+            case 'a':
+                address_arg = optarg;
+                address_count = getAddressList(optarg, addresses);
+
+                if (address_count == 0) {
+                    fprintf (stderr, "%s: Address must be between 1 and 247, or a list like 1,2,5-12.\n", programName);
+                    exit(EXIT_FAILURE);
+                }
+                device_address = addresses[0];
+                log_message(debug_flag | DEBUG_SYSLOG, "device_address = %d, address_count = %d", device_address, address_count);
+                break;
+            case 'v':
+                volt_flag = 1;
+                count_param++;
+                log_message(debug_flag | DEBUG_SYSLOG, "volt_flag = %d, count_param = %d", volt_flag, count_param);
+                break;
+            case 'p':
+                power_flag = 1;
+                count_param++;
+                log_message(debug_flag | DEBUG_SYSLOG, "power_flag = %d, count_param = %d", power_flag, count_param);
+                break;
+            case 'c':
+                current_flag = 1;
+                count_param++;
+                log_message(debug_flag | DEBUG_SYSLOG, "current_flag = %d, count_param = %d", current_flag, count_param);
+                break;
+            case 't':
+                total_flag = 1;
+                count_param++;
+                log_message(debug_flag | DEBUG_SYSLOG, "total_flag = %d, count_param = %d", total_flag, count_param);
+                break;
+            case 'f':
+                freq_flag = 1;
+                count_param++;
+                log_message(debug_flag | DEBUG_SYSLOG, "freq_flag = %d, count_param = %d", freq_flag, count_param);
+                break;
+            case 'g':
+                pf_flag = 1;
+                count_param++;
+                log_message(debug_flag | DEBUG_SYSLOG, "pf_flag = %d, count_param = %d", pf_flag, count_param);
+                break;
+            case 'd':
+                switch (*optarg) {
+                    case '0':
+                    case '1':
+                    case '2':
+                    case '3':
+                        debug_flag = atoi(optarg) & DEBUG_STDERR;
+                        debug_mask = atoi(optarg);
+                        break;
+                    default:
+                         fprintf (stderr, "%s: Debug value must be one of 0,1,2,3.\n", programName);
+                         exit(EXIT_FAILURE);
+                }
+                log_message(debug_flag | DEBUG_SYSLOG, "debug_flag = %d", debug_flag);
+                break;
+            case 'x':
+                trace_flag = 1;
+                log_message(debug_flag | DEBUG_SYSLOG, "trace_flag = %d, count_param = %d", trace_flag, count_param);
+                break;
+            case 's':
+                new_address = atoi(optarg);
+                if (!(0 < new_address && new_address <= 247)) {
+                    fprintf (stderr, "%s: New address (%d) out of range, 1-247.\n", programName, new_address);
+                    exit(EXIT_FAILURE);
+                }
+                log_message(debug_flag | DEBUG_SYSLOG, "new_address = %d, count_param = %d", new_address, count_param);
+                break;
+            case 'm':
+                metern_flag = 1;
+                log_message(debug_flag | DEBUG_SYSLOG, "metern_flag = %d, count_param = %d", metern_flag, count_param);
+                break;
+            case 'q':
+                compact_flag = 1;
+                log_message(debug_flag | DEBUG_SYSLOG, "compact_flag = %d, count_param = %d", compact_flag, count_param);
+                break;
+            case 'z':
+                num_retries = atoi(optarg);
+                if (!(0 < num_retries && num_retries <= MAX_RETRIES)) {
+                    fprintf (stderr, "%s: num_retries (%d) out of range, 1-%d.\n", programName, num_retries, MAX_RETRIES);
+                    exit(EXIT_FAILURE);
+                }
+                log_message(debug_flag | DEBUG_SYSLOG, "num_retries = %d, count_param = %d", num_retries, count_param);
+                break;
+            case 'j':
+                resp_timeout = atoi(optarg);
+                if (resp_timeout < 1 || resp_timeout > 500) {
+                    fprintf(stderr, "%s: -j Response timeout (%lu) out of range, 0-500.\n",programName,(long unsigned)resp_timeout);
+                    exit(EXIT_FAILURE);
+                }
+                log_message(debug_flag | DEBUG_SYSLOG, "resp_timeout = %d, count_param = %d", resp_timeout, count_param);
+                break;
+            case 'y':
+                byte_timeout = atoi(optarg);
+                if (byte_timeout < 1 || byte_timeout > 500) {
+                    fprintf(stderr, "%s: -y Byte timeout (%lu) out of range, 1-500.\n",programName,(long unsigned)byte_timeout);
+                    exit(EXIT_FAILURE);
+                }
+                log_message(debug_flag | DEBUG_SYSLOG, "byte_timeout = %d, count_param = %d", byte_timeout, count_param);
+                break;
+            case 'w':
+                yLockWait = atoi(optarg);
+                if (yLockWait < 1 || yLockWait > 30) {
+                    fprintf(stderr, "%s: -w Lock Wait seconds (%d) out of range, 1-30.\n",programName,yLockWait);
+                    exit(EXIT_FAILURE);
+                }
+                log_message(debug_flag | DEBUG_SYSLOG, "yLockWait = %d, count_param = %d", yLockWait, count_param);
+                break;
+            case 'W':
+                settle_time = atoi(optarg);
+                log_message(debug_flag | DEBUG_SYSLOG, "settle_time = %d, count_param = %d", settle_time, count_param);
+                break;
+            case 'D':
+                command_delay = atoi(optarg);
+                log_message(debug_flag | DEBUG_SYSLOG, "command_delay = %d, count_param = %d", command_delay, count_param);
+                break;
+            case OPT_MAXAGE:
+                max_age_ms = atol(optarg);
+                if (max_age_ms < 1 || max_age_ms > 3600000) {
+                    fprintf(stderr, "%s: --max-age (%ld) out of range, 1-3600000ms.\n", programName, max_age_ms);
+                    exit(EXIT_FAILURE);
+                }
+                log_message(debug_flag | DEBUG_SYSLOG, "max_age_ms = %ld", max_age_ms);
+                break;
+            case OPT_ADAPTIVE:
+                adaptive_timeout = 1;
+                log_message(debug_flag | DEBUG_SYSLOG, "adaptive_timeout = %d", adaptive_timeout);
+                break;
+            case OPT_LCKFILE:
+                legacy_lock = 1;
+                log_message(debug_flag | DEBUG_SYSLOG, "legacy_lock = %d", legacy_lock);
+                break;
+            case OPT_DAEMON:
+                daemon_flag = 1;
+                log_message(debug_flag | DEBUG_SYSLOG, "daemon_flag = %d", daemon_flag);
+                break;
+            case OPT_SOCKET:
+                socket_path = optarg;
+                log_message(debug_flag | DEBUG_SYSLOG, "socket_path = %s", socket_path);
+                break;
+            case OPT_INTERVAL:
+                interval_ms = atol(optarg);
+                if (interval_ms < 100 || interval_ms > 3600000) {
+                    fprintf(stderr, "%s: --interval (%ld) out of range, 100-3600000ms.\n", programName, interval_ms);
+                    exit(EXIT_FAILURE);
+                }
+                log_message(debug_flag | DEBUG_SYSLOG, "interval_ms = %ld", interval_ms);
+                break;
+            case '?':
+                if (isprint (optopt)) {
+                    fprintf (stderr, "%s: Unknown option `-%c'.\n", programName, optopt);
+                    usage(programName);
+                    exit(EXIT_FAILURE);
+                } else {
+                    fprintf (stderr,"%s: Unknown option character `\\x%x'.\n",programName, optopt);
+                    usage(programName);
+                    exit(EXIT_FAILURE);
+                }
+            default:
+                fprintf (stderr, "%s: Unknown option `-%c'.\n", programName, optopt);
+                usage(programName);
+                exit(EXIT_FAILURE);
+        }
+    }
+
+    log_message(debug_flag, "cmdline=\"%s\"", cmdline);
+
+    if (compact_flag == 1 && metern_flag == 1) {
+        fprintf(stderr, "%s: Parameter -m and -q are mutually exclusive\n", programName);
+        usage(programName);
+        exit(EXIT_FAILURE);
+    }
+
+    if (volt_flag)    mask |= MEASURE_BIT(M_VOLTAGE);
+    if (current_flag) mask |= MEASURE_BIT(M_CURRENT);
+    if (power_flag)   mask |= MEASURE_BIT(M_POWER);
+    if (pf_flag)      mask |= MEASURE_BIT(M_PFACTOR);
+    if (freq_flag)    mask |= MEASURE_BIT(M_FREQUENCY);
+    if (total_flag)   mask |= MEASURE_BIT(M_TAENERGY);
+    if (mask == 0) mask = MEASURE_ALL;     // if no parameter, retrieve all values
+    measure_mask = mask;
+    output_format = metern_flag ? OUT_IEC : (compact_flag ? OUT_COMPACT : OUT_DEFAULT);
+
+    if (socket_path != NULL && !daemon_flag) {
+        // Query a running daemon, the serial port is not touched
+        free(PARENTCOMMAND);
+        return queryDaemon(socket_path, output_format, mask, address_arg);
+    }
+        
+    if (optind >= argc) {              /* get serial device names */
+        log_message(debug_flag, "optind = %d, argc = %d", optind, argc);
+        usage(programName);
+        fprintf(stderr, "%s: No serial device specified\n", programName);
+        exit(EXIT_FAILURE);
+    }
+    if (argc - optind > MAX_BUSES) {
+        fprintf(stderr, "%s: Too many serial devices, max %d\n", programName, MAX_BUSES);
+        exit(EXIT_FAILURE);
+    }
+
+    memset(buses, 0, sizeof(buses));
+    for (; optind < argc; optind++) {
+        for (b = 0; b < nbus && strcmp(buses[b].device, argv[optind]) != 0; b++);
+        if (b < nbus) {
+            fprintf(stderr, "%s: Serial device %s given twice\n", programName, argv[optind]);
+            exit(EXIT_FAILURE);
+        }
+        buses[nbus].device = argv[optind];
+        buses[nbus].count = address_count;
+        buses[nbus].readings = getMemPtr(address_count * sizeof(reading_t));
+        nbus++;
+    }
+    for (b = 0; b < nbus; b++) {
+        for (i = 0; i < address_count; i++) {
+            buses[b].readings[i].address = addresses[i];
+            if (nbus > 1) buses[b].readings[i].bus = strrchr(buses[b].device, '/') ? strrchr(buses[b].device, '/') + 1 : buses[b].device;
+        }
+    }
+
+    if (daemon_flag && new_address > 0) {
+        fprintf(stderr, "%s: Parameter -s can't be used in daemon mode\n", programName);
+        exit(EXIT_FAILURE);
+    }
+
+    if ((address_count > 1 || nbus > 1) && new_address > 0) {
+        fprintf(stderr, "%s: Parameter -s needs a single meter address and device\n", programName);
+        exit(EXIT_FAILURE);
+    }
+
+    // Response timeout
+    resp_timeout *= 100000;    
+    log_message(debug_flag, "resp_timeout=%ldus", resp_timeout);
+    
+    // Byte timeout
+    if (byte_timeout != -1) {
+        byte_timeout *= 1000;    
+        log_message(debug_flag, "byte_timeout=%ldus", byte_timeout);
+    }
+    
+    // Command delay
+    if (command_delay == -1) {
+        command_delay = 0;      // default = no command delay
+    } else { 
+        command_delay *= 1000;        
+        log_message(debug_flag, "command_delay=%ldus", command_delay);
+    }
+
+    // Settle time delay
+    if (settle_time == -1)
+        settle_time = 0;        // default = no settle time
+    else {
+        settle_time *= 1000;
+        log_message(debug_flag, "settle_time=%ldus", settle_time);
+    }
+
+	if (new_address > 0) {
+
+        log_message(DEBUG_STDERR, "new_address = %d > 0, count_param = %d", new_address, count_param);
+
+        if (count_param > 0) {
+            usage(programName);
+            exit(EXIT_FAILURE);
+        }
+        if ((rc = openBus(&buses[0])) != 0) exit(rc);
+        // change Address
+        log_message(debug_flag, "Before change Address\n");
+        changeConfigHex(&buses[0], DEVICE_ID, new_address, RESTART_FALSE);
+        closeBus(&buses[0]);
+        return 0;
+    }
+
+    if (daemon_flag) {
+        pthread_condattr_t attr;
+        int listen_fd;
+
+        pthread_condattr_init(&attr);
+        pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+        pthread_cond_init(&terminate_cond, &attr);
+
+        for (b = 0; b < nbus; b++) {
+            if ((rc = openBus(&buses[b])) != 0) {
+                while (b-- > 0) closeBus(&buses[b]);
+                exit(rc);
+            }
+        }
+
+        listen_fd = openServerSocket(socket_path != NULL ? socket_path : DEFAULT_SOCKET);
+        if (listen_fd == -1) {
+            for (b = 1; b < nbus; b++) closeBus(&buses[b]);
+            exit_error(&buses[0]);
+        }
+
+        signal(SIGTERM, sig_terminate);
+        signal(SIGINT, sig_terminate);
+        signal(SIGPIPE, SIG_IGN);
+
+        runDaemon(listen_fd, buses, nbus);
+
+        close(listen_fd);
+        unlink(socket_path != NULL ? socket_path : DEFAULT_SOCKET);
+        for (b = 0; b < nbus; b++) {
+            closeBus(&buses[b]);
+            free(buses[b].readings);
+        }
         free(PARENTCOMMAND);
-        if (!metern_flag) printf("OK\n");
+        return 0;
+    }
+
+    if (nbus == 1) {
+        // Plain single bus read, no thread needed
+        if ((rc = readBus(&buses[0], stdout)) != 0) exit(rc);
+        failed = buses[0].failed;
     } else {
-        exit_error(ctx);
+        // One worker per bus, the site takes as long as the slowest bus
+        for (b = 0; b < nbus; b++) {
+            if (pthread_create(&buses[b].thread, NULL, readBusWorker, &buses[b]) != 0) {
+                log_message(DEBUG_STDERR | DEBUG_SYSLOG, "Unable to start the worker for %s", buses[b].device);
+                readBusWorker(&buses[b]);
+                buses[b].thread = pthread_self();
+            }
+        }
+        for (b = 0; b < nbus; b++) {
+            if (!pthread_equal(buses[b].thread, pthread_self())) pthread_join(buses[b].thread, NULL);
+            if (buses[b].output != NULL) fwrite(buses[b].output, 1, buses[b].output_size, stdout);
+            free(buses[b].output);
+            failed += buses[b].failed;
+        }
     }
 
+    for (b = 0; b < nbus; b++) free(buses[b].readings);
+    free(PARENTCOMMAND);
+
+    if (failed) {
+        log_message(debug_flag | DEBUG_SYSLOG, "NOK");
+        return EXIT_FAILURE;
+    }
     return 0;
 }
 